@@ -0,0 +1,150 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+//
+//Per-frame bump allocator.
+//
+//Transient per-frame data (draw lists, collision pairs, buckets...) is
+//carved out of one block and thrown away all at once with reset() at the
+//end of the frame. If a frame asks for more than the block holds, the
+//extra comes from the heap and the block is regrown to the high-water
+//mark on the next reset, so steady-state frames never touch the heap.
+//
+//Every thread gets its own arena through frame_arena().
+//Debug builds (no NDEBUG) poison released memory with 0xdd.
+//
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#define ARENA_POISON 0xdd
+
+class Arena {
+    private:
+	struct Overflow {
+	    Overflow *next;
+	};
+	char *base;
+	size_t cap;
+	size_t top;
+	size_t spill;          //bytes handed out from overflow blocks
+	Overflow *overflow;
+	static size_t align_up(size_t n, size_t a) {
+	    return (n + a - 1) & ~(a - 1);
+	}
+	void *heap_block(size_t size) {
+	    ++blocks;
+	    void *p = malloc(size);
+	    if (p == NULL)
+		throw std::bad_alloc();
+	    return p;
+	}
+    public:
+	//statistics
+	size_t high;           //most bytes used by any one frame
+	unsigned long blocks;  //heap blocks ever requested by this arena
+	unsigned long frames;
+
+	Arena(size_t size = 64 * 1024) {
+	    cap = size;
+	    top = spill = 0;
+	    overflow = NULL;
+	    high = 0;
+	    blocks = frames = 0;
+	    base = (char *)heap_block(cap);
+	}
+	~Arena() {
+	    release_overflow();
+	    free(base);
+	}
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	void *alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+	    size_t start = align_up(top, align);
+	    if (start + size <= cap) {
+		top = start + size;
+		return base + start;
+	    }
+	    //Out of room this frame: fall back to the heap and remember
+	    //how much we needed so reset() can grow the block.
+	    size_t hdr = align_up(sizeof(Overflow), align);
+	    Overflow *o = (Overflow *)heap_block(hdr + size);
+	    o->next = overflow;
+	    overflow = o;
+	    spill += size + align;
+	    return (char *)o + hdr;
+	}
+	template <class T>
+	T *alloc_array(size_t n) {
+	    return (T *)alloc(n * sizeof(T), alignof(T));
+	}
+	size_t used() const { return top + spill; }
+	size_t capacity() const { return cap; }
+
+	//Throw away everything allocated since the last reset.
+	void reset() {
+	    size_t u = used();
+	    if (u > high)
+		high = u;
+#ifndef NDEBUG
+	    memset(base, ARENA_POISON, top);
+#endif
+	    if (overflow) {
+		release_overflow();
+		//Grow once to the high-water mark plus some slack.
+		free(base);
+		cap = align_up(high + high / 2, 4096);
+		base = (char *)heap_block(cap);
+	    }
+	    top = spill = 0;
+	    ++frames;
+	}
+    private:
+	void release_overflow() {
+	    while (overflow) {
+		Overflow *next = overflow->next;
+		free(overflow);
+		overflow = next;
+	    }
+	}
+};
+
+//One arena per thread, reset by its owner at the end of each frame.
+inline Arena &frame_arena()
+{
+    static thread_local Arena a;
+    return a;
+}
+
+//STL allocator adapter: memory is never returned individually,
+//only when the arena is reset.
+template <class T>
+class ArenaAllocator {
+    public:
+	typedef T value_type;
+	Arena *arena;
+	ArenaAllocator(Arena &a) : arena(&a) { }
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U> &o) : arena(o.arena) { }
+	T *allocate(size_t n) { return arena->alloc_array<T>(n); }
+	void deallocate(T *, size_t) { }
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena != b.arena;
+}
+
+template <class T>
+using FrameVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif //_ARENA_H_
@@ -0,0 +1,290 @@
+#ifndef _DOMAIN_H_
+#define _DOMAIN_H_
+//
+//Domain-decomposed simulation over shared memory.
+//
+//The window is cut into N vertical strips and each strip is stepped by
+//its own worker process (forked from the renderer). Everything the
+//processes share lives in one MAP_SHARED mapping made before fork():
+//
+//  - per strip, single-producer/single-consumer rings to the left and
+//    right neighbours; a particle whose x leaves the strip is pushed to
+//    the neighbour that now owns it
+//  - per strip, an inject ring the renderer uses to hand over newly
+//    spawned particles
+//  - per strip, a seqlock-protected snapshot the renderer gathers from
+//    every frame
+//
+//The renderer raises tick_target once per frame and the workers step
+//until they reach it, so the simulation runs at the frame rate as
+//before. A worker that has caught up sleeps in a futex on tick_target,
+//so idle strips cost no CPU. The strips are loosely coupled: a particle
+//that crosses a boundary is stepped by its new owner from the next
+//tick on.
+//
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <new>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define DOMAIN_MAX_STRIPS 16
+#define DOMAIN_RING 1024          //slots per ring, power of two
+
+static_assert(std::atomic<unsigned int>::is_always_lock_free,
+	"shared-memory rings need address-free atomics");
+static_assert(sizeof(std::atomic<unsigned int>) == sizeof(unsigned int),
+	"tick_target doubles as a futex word");
+
+//Shared (not FUTEX_PRIVATE) futex calls: the word lives in a mapping
+//used by several processes.
+inline void domain_futex_wait(std::atomic<unsigned int> *word,
+	unsigned int val)
+{
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+inline void domain_futex_wake(std::atomic<unsigned int> *word)
+{
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAKE, INT_MAX,
+	    NULL, NULL, 0);
+}
+
+//Lock-free single-producer/single-consumer ring.
+template <class T, int N>
+struct SpscRing {
+    alignas(64) std::atomic<unsigned int> head;   //advanced by the consumer
+    alignas(64) std::atomic<unsigned int> tail;   //advanced by the producer
+    T item[N];
+
+    SpscRing() : head(0), tail(0) { }
+    bool push(const T &v) {
+	unsigned int t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == (unsigned int)N)
+	    return false;
+	item[t & (N - 1)] = v;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+    }
+    unsigned int size() const {
+	return tail.load(std::memory_order_acquire) -
+	    head.load(std::memory_order_acquire);
+    }
+    bool pop(T &v) {
+	unsigned int h = head.load(std::memory_order_relaxed);
+	if (h == tail.load(std::memory_order_acquire))
+	    return false;
+	v = item[h & (N - 1)];
+	head.store(h + 1, std::memory_order_release);
+	return true;
+    }
+};
+
+template <class P, int CAP>
+struct DomainStrip {
+    SpscRing<P, DOMAIN_RING> to_left;
+    SpscRing<P, DOMAIN_RING> to_right;
+    SpscRing<P, DOMAIN_RING> inject;
+    std::atomic<unsigned int> tick;
+    std::atomic<unsigned long> killed;
+    std::atomic<unsigned long> dropped;     //arrivals with the strip full
+    //snapshot for the renderer, odd seq = being written
+    alignas(64) std::atomic<unsigned int> seq;
+    int n;
+    P snap[CAP];
+};
+
+template <class P, int CAP>
+struct Domain {
+    std::atomic<int> quit;
+    std::atomic<int> xres;
+    std::atomic<unsigned int> tick_target;    //also the workers' futex
+    int nstrips;
+    pid_t pid[DOMAIN_MAX_STRIPS];
+    DomainStrip<P, CAP> strip[DOMAIN_MAX_STRIPS];
+
+    //Strip that owns x. The outer strips reach to +-infinity.
+    int owner(float x) const {
+	int k = (int)(x * nstrips / xres.load(std::memory_order_relaxed));
+	if (k < 0)
+	    return 0;
+	return k < nstrips ? k : nstrips - 1;
+    }
+    //Particles between strips, i.e. in no snapshot right now.
+    int pending() const {
+	unsigned int p = 0;
+	for (int k=0; k<nstrips; k++) {
+	    p += strip[k].to_left.size() + strip[k].to_right.size() +
+		strip[k].inject.size();
+	}
+	return p;
+    }
+};
+
+template <class P, int CAP>
+struct DomainWorker {
+    //Per-process particle storage and step function of the worker.
+    P *part;
+    int *n;
+    float (*xof)(const P &);
+    void (*step)(void);
+    unsigned long (*kills)(void);
+};
+
+template <class P, int CAP>
+void domain_take(Domain<P, CAP> *d, int k, SpscRing<P, DOMAIN_RING> &r,
+	const DomainWorker<P, CAP> &w)
+{
+    P p;
+    while (r.pop(p)) {
+	if (*w.n < CAP)
+	    w.part[(*w.n)++] = p;
+	else
+	    d->strip[k].dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//Body of a strip process. Never returns.
+template <class P, int CAP>
+void domain_worker(Domain<P, CAP> *d, int k, DomainWorker<P, CAP> w)
+{
+    DomainStrip<P, CAP> &s = d->strip[k];
+    *w.n = 0;
+    unsigned int tick = 0;
+    while (!d->quit.load(std::memory_order_relaxed)) {
+	unsigned int target = d->tick_target.load(std::memory_order_acquire);
+	if (tick == target) {
+	    //Sleeps unless the target moved since the load above.
+	    domain_futex_wait(&d->tick_target, target);
+	    continue;
+	}
+	//arrivals: new spawns and particles from the neighbours
+	domain_take(d, k, s.inject, w);
+	if (k > 0)
+	    domain_take(d, k, d->strip[k-1].to_right, w);
+	if (k < d->nstrips-1)
+	    domain_take(d, k, d->strip[k+1].to_left, w);
+
+	unsigned long k0 = w.kills();
+	w.step();
+	s.killed.fetch_add(w.kills() - k0, std::memory_order_relaxed);
+
+	//departures; a full ring keeps the particle here for a tick
+	for (int i=0; i<*w.n; ) {
+	    int o = d->owner(w.xof(w.part[i]));
+	    bool gone = false;
+	    if (o < k)
+		gone = s.to_left.push(w.part[i]);
+	    else if (o > k)
+		gone = s.to_right.push(w.part[i]);
+	    if (gone)
+		w.part[i] = w.part[--(*w.n)];
+	    else
+		++i;
+	}
+
+	//publish
+	s.seq.fetch_add(1, std::memory_order_acq_rel);
+	std::atomic_thread_fence(std::memory_order_release);
+	s.n = *w.n;
+	for (int i=0; i<*w.n; i++)
+	    s.snap[i] = w.part[i];
+	s.seq.fetch_add(1, std::memory_order_release);
+	s.tick.store(++tick, std::memory_order_release);
+    }
+    _exit(0);
+}
+
+//Stop and reap the workers, then unmap.
+template <class P, int CAP>
+void domain_stop(Domain<P, CAP> *d)
+{
+    d->quit.store(1);
+    //Move the target too, so a worker about to sleep does not.
+    d->tick_target.fetch_add(1, std::memory_order_release);
+    domain_futex_wake(&d->tick_target);
+    for (int k=0; k<d->nstrips; k++)
+	waitpid(d->pid[k], NULL, 0);
+    d->~Domain<P, CAP>();
+    munmap(d, sizeof(*d));
+}
+
+//Map the shared state and fork one worker per strip.
+//Returns NULL if the mapping or a fork fails.
+template <class P, int CAP>
+Domain<P, CAP> *domain_start(int nstrips, int xres, DomainWorker<P, CAP> w)
+{
+    typedef Domain<P, CAP> D;
+    if (nstrips < 1 || nstrips > DOMAIN_MAX_STRIPS)
+	return NULL;
+    void *mem = mmap(NULL, sizeof(D), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+	return NULL;
+    D *d = new (mem) D();
+    d->quit.store(0);
+    d->xres.store(xres);
+    d->tick_target.store(0);
+    d->nstrips = nstrips;
+    pid_t parent = getpid();
+    for (int k=0; k<nstrips; k++) {
+	pid_t pid = fork();
+	if (pid == 0) {
+	    //Do not outlive the renderer.
+	    prctl(PR_SET_PDEATHSIG, SIGTERM);
+	    if (getppid() != parent)
+		_exit(0);
+	    domain_worker(d, k, w);
+	}
+	if (pid < 0) {
+	    d->nstrips = k;
+	    domain_stop(d);
+	    return NULL;
+	}
+	d->pid[k] = pid;
+    }
+    return d;
+}
+
+//Hand a new particle to the strip that owns it.
+template <class P, int CAP>
+bool domain_inject(Domain<P, CAP> *d, const P &p, float x)
+{
+    return d->strip[d->owner(x)].inject.push(p);
+}
+
+//Release one more tick, then copy every strip's latest snapshot into
+//out[]. Returns the number of particles gathered.
+template <class P, int CAP>
+int domain_gather(Domain<P, CAP> *d, P *out, int cap)
+{
+    d->tick_target.fetch_add(1, std::memory_order_release);
+    domain_futex_wake(&d->tick_target);
+    int n = 0;
+    for (int k=0; k<d->nstrips; k++) {
+	DomainStrip<P, CAP> &s = d->strip[k];
+	for (;;) {
+	    unsigned int s0 = s.seq.load(std::memory_order_acquire);
+	    if (s0 & 1)
+		continue;
+	    int m = s.n;
+	    if (m > cap - n)
+		m = cap - n;
+	    for (int i=0; i<m; i++)
+		out[n + i] = s.snap[i];
+	    std::atomic_thread_fence(std::memory_order_acquire);
+	    if (s.seq.load(std::memory_order_relaxed) == s0) {
+		n += m;
+		break;
+	    }
+	}
+    }
+    return n;
+}
+
+#endif //_DOMAIN_H_
@@ -0,0 +1,247 @@
+#ifndef _DRAWLIST_H_
+#define _DRAWLIST_H_
+//
+//Render command buffer.
+//
+//render() records draw items here instead of calling GL directly.
+//Every item gets a 32-bit sort key:
+//
+//   bits 31..28  layer     (boxes, text, particles, HUD)
+//   bits 27..20  texture   (0 = plain quad, otherwise a font atlas)
+//   bits 19..0   material  (index into the colour table)
+//
+//submit() radix sorts the items by key and issues them as merged runs:
+//one glBegin(GL_QUADS) per run of plain quads and one glColor per
+//material change, with no matrix push/pop per quad. The sort is stable,
+//so items with equal keys keep the order they were recorded in.
+//
+//libggfonts only toggles GL_ALPHA_TEST and binds its atlas, so submit()
+//turns GL_TEXTURE_2D on for each run of text and off again for quads.
+//
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <GL/gl.h>
+#include "arena.h"
+#include "fontcache.h"
+
+enum {
+    LAYER_BOXES = 0,
+    LAYER_TEXT,
+    LAYER_PARTICLES,
+    LAYER_HUD
+};
+
+#define MAX_MATERIALS 256
+
+struct DrawCmd {
+    unsigned int key;
+    float x, y;            //quad centre, or text left/bottom
+    float w, h;            //quad half extents
+    int color;             //text colour 0x00rrggbb
+    const char *text;
+};
+
+class DrawList {
+    private:
+	struct SortItem {
+	    unsigned int key;
+	    unsigned int idx;
+	};
+	Arena *arena;
+	DrawCmd *cmd;
+	int n, max;
+	unsigned char mat[MAX_MATERIALS][3];
+	int nmat;
+
+	static unsigned int make_key(int layer, int tex, int material) {
+	    return ((unsigned int)layer << 28) |
+		((unsigned int)(tex & 0xff) << 20) |
+		((unsigned int)material & 0xfffff);
+	}
+	DrawCmd *push() {
+	    if (n >= max)
+		return NULL;
+	    return &cmd[n++];
+	}
+	//LSD radix sort, 8 bits per pass. Passes where every key
+	//has the same digit are skipped.
+	SortItem *sort() {
+	    SortItem *a = arena->alloc_array<SortItem>(n);
+	    SortItem *b = arena->alloc_array<SortItem>(n);
+	    for (int i=0; i<n; i++) {
+		a[i].key = cmd[i].key;
+		a[i].idx = i;
+	    }
+	    for (int shift=0; shift<32; shift+=8) {
+		int count[256];
+		memset(count, 0, sizeof(count));
+		for (int i=0; i<n; i++)
+		    ++count[(a[i].key >> shift) & 0xff];
+		if (count[(a[0].key >> shift) & 0xff] == n)
+		    continue;
+		int sum = 0;
+		for (int d=0; d<256; d++) {
+		    int c = count[d];
+		    count[d] = sum;
+		    sum += c;
+		}
+		for (int i=0; i<n; i++)
+		    b[count[(a[i].key >> shift) & 0xff]++] = a[i];
+		SortItem *t = a; a = b; b = t;
+	    }
+	    return a;
+	}
+	void draw_text(const DrawCmd &c) {
+	    Rect r;
+	    r.left = (int)c.x;
+	    r.bot = (int)c.y;
+	    r.center = 0;
+	    int font = (c.key >> 20) & 0xff;
+	    font_require(font);
+	    switch (font) {
+		case FONT_06: ggprint06(&r, 0, c.color, "%s", c.text); break;
+		case FONT_07: ggprint07(&r, 0, c.color, "%s", c.text); break;
+		case FONT_08: ggprint08(&r, 0, c.color, "%s", c.text); break;
+		case FONT_10: ggprint10(&r, 0, c.color, "%s", c.text); break;
+		case FONT_12: ggprint12(&r, 0, c.color, "%s", c.text); break;
+		case FONT_13: ggprint13(&r, 0, c.color, "%s", c.text); break;
+		case FONT_16: ggprint16(&r, 0, c.color, "%s", c.text); break;
+		case FONT_17: ggprint17(&r, 0, c.color, "%s", c.text); break;
+		case FONT_40: ggprint40(&r, 0, c.color, "%s", c.text); break;
+		case FONT_8B: ggprint8b(&r, 0, c.color, "%s", c.text); break;
+	    }
+	}
+	//Fonts draw_text() has a print function for.
+	static bool font_printable(int font) {
+	    switch (font) {
+		case FONT_06: case FONT_07: case FONT_08: case FONT_8B:
+		case FONT_10: case FONT_12: case FONT_13: case FONT_16:
+		case FONT_17: case FONT_40:
+		    return true;
+	    }
+	    return false;
+	}
+    public:
+	int state_changes;     //GL state changes made by the last submit()
+
+	DrawList() {
+	    arena = NULL;
+	    cmd = NULL;
+	    n = max = nmat = 0;
+	    state_changes = 0;
+	}
+	//Start a new frame. The list lives in the arena until it is reset.
+	void begin(Arena &a, int max_items) {
+	    arena = &a;
+	    cmd = a.alloc_array<DrawCmd>(max_items);
+	    max = max_items;
+	    n = 0;
+	}
+	int size() const { return n; }
+	//Colour -> material id. The table persists across frames.
+	int material(const unsigned char c[3]) {
+	    for (int i=0; i<nmat; i++) {
+		if (memcmp(mat[i], c, 3) == 0)
+		    return i;
+	    }
+	    if (nmat == MAX_MATERIALS)
+		return 0;
+	    memcpy(mat[nmat], c, 3);
+	    return nmat++;
+	}
+	void quad(int layer, int material, float x, float y, float w, float h) {
+	    DrawCmd *c = push();
+	    if (c == NULL)
+		return;
+	    c->key = make_key(layer, 0, material);
+	    c->x = x;
+	    c->y = y;
+	    c->w = w;
+	    c->h = h;
+	    c->text = NULL;
+	}
+	//Unknown font ids are a programming error: asserted in debug
+	//builds, dropped in release builds.
+	void textf(int layer, int font, int x, int y, int color,
+		const char *fmt, ...) {
+	    assert(font_printable(font));
+	    if (!font_printable(font))
+		return;
+	    DrawCmd *c = push();
+	    if (c == NULL)
+		return;
+	    char buf[256];
+	    va_list ap;
+	    va_start(ap, fmt);
+	    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	    va_end(ap);
+	    if (len < 0)
+		len = 0;
+	    if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	    char *s = arena->alloc_array<char>(len + 1);
+	    memcpy(s, buf, len);
+	    s[len] = '\0';
+	    c->key = make_key(layer, font, 0);
+	    c->x = x;
+	    c->y = y;
+	    c->color = color;
+	    c->text = s;
+	}
+	void submit() {
+	    state_changes = 0;
+	    if (n == 0)
+		return;
+	    SortItem *order = sort();
+	    int cur_mat = -1;
+	    bool in_quads = false;
+	    bool textured = false;
+	    for (int i=0; i<n; i++) {
+		const DrawCmd &c = cmd[order[i].idx];
+		if (((c.key >> 20) & 0xff) != 0) {
+		    if (in_quads) {
+			glEnd();
+			in_quads = false;
+		    }
+		    if (!textured) {
+			glEnable(GL_TEXTURE_2D);
+			textured = true;
+			++state_changes;
+		    }
+		    draw_text(c);
+		    //The font code binds its atlas and sets its own colour.
+		    ++state_changes;
+		    cur_mat = -1;
+		    continue;
+		}
+		int m = c.key & 0xfffff;
+		if (textured) {
+		    glDisable(GL_TEXTURE_2D);
+		    textured = false;
+		    ++state_changes;
+		}
+		if (!in_quads) {
+		    glBegin(GL_QUADS);
+		    in_quads = true;
+		    ++state_changes;
+		}
+		if (m != cur_mat) {
+		    glColor3ubv(mat[m]);
+		    cur_mat = m;
+		    ++state_changes;
+		}
+		glVertex2f(c.x - c.w, c.y - c.h);
+		glVertex2f(c.x - c.w, c.y + c.h);
+		glVertex2f(c.x + c.w, c.y + c.h);
+		glVertex2f(c.x + c.w, c.y - c.h);
+	    }
+	    if (in_quads)
+		glEnd();
+	    if (textured)
+		glDisable(GL_TEXTURE_2D);
+	}
+};
+
+#endif //_DRAWLIST_H_
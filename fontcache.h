@@ -0,0 +1,251 @@
+#ifndef _FONTCACHE_H_
+#define _FONTCACHE_H_
+//
+//Lazy, cached font atlas loading for libggfonts.
+//
+//initialize_fonts() decodes and uploads all ten atlases. Instead,
+//call font_require(id) before printing with a size: the atlas is loaded
+//the first time it is needed and never again.
+//
+//A decoded atlas (RGBA texels plus the glyph tables) is written to
+//$GGFONT_CACHE/ggfont-<id>.bin (default $XDG_CACHE_HOME/lab2, else
+//~/.cache/lab2). Later runs mmap that file and upload it straight to GL
+//instead of decoding the embedded PPM.
+//
+//Only files we own and nobody else can write are trusted, and each
+//carries GGFONT_FINGERPRINT (the Makefile's checksum of libggfonts.a),
+//so a rebuilt font library never picks up stale atlases.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <GL/gl.h>
+#include "fonts.h"
+
+#ifndef GGFONT_FINGERPRINT
+#define GGFONT_FINGERPRINT 0u
+#endif
+
+//Atlas ids, numbered the way libggfonts' load_ggfont() numbers them.
+#define FONT_06  6
+#define FONT_07  7
+#define FONT_08  8
+#define FONT_8B  108
+#define FONT_10  10
+#define FONT_12  12
+#define FONT_13  13
+#define FONT_16  16
+#define FONT_17  17
+#define FONT_40  40
+
+//libggfonts internals (not in fonts.h)
+extern void load_ggfont(int id);
+extern void ggprint17(Rect *r, int advance, int cref, const char *fmt, ...);
+extern void ggprint40(Rect *r, int advance, int cref, const char *fmt, ...);
+
+#define GGFONT_GLYPHS 128
+#define FONT_ATLAS_DECL(s) \
+    extern unsigned int s##_texture_no; \
+    extern int cstart_##s[GGFONT_GLYPHS], clen_##s[GGFONT_GLYPHS]; \
+    extern float tx_##s[GGFONT_GLYPHS][2], ty_##s[GGFONT_GLYPHS][2];
+FONT_ATLAS_DECL(a06)
+FONT_ATLAS_DECL(a07)
+FONT_ATLAS_DECL(a08)
+FONT_ATLAS_DECL(a8b)
+FONT_ATLAS_DECL(a10)
+FONT_ATLAS_DECL(a12)
+FONT_ATLAS_DECL(a13)
+FONT_ATLAS_DECL(a16)
+FONT_ATLAS_DECL(c17)
+FONT_ATLAS_DECL(a40)
+
+struct FontAtlas {
+    int id;
+    unsigned int *tex;
+    int *cstart, *clen;
+    float (*tx)[2], (*ty)[2];
+    bool loaded;
+};
+
+#define FONT_ATLAS(id, s) \
+    { id, &s##_texture_no, cstart_##s, clen_##s, tx_##s, ty_##s, false }
+
+static FontAtlas font_atlas[] = {
+    FONT_ATLAS(FONT_06, a06),
+    FONT_ATLAS(FONT_07, a07),
+    FONT_ATLAS(FONT_08, a08),
+    FONT_ATLAS(FONT_8B, a8b),
+    FONT_ATLAS(FONT_10, a10),
+    FONT_ATLAS(FONT_12, a12),
+    FONT_ATLAS(FONT_13, a13),
+    FONT_ATLAS(FONT_16, a16),
+    FONT_ATLAS(FONT_17, c17),
+    FONT_ATLAS(FONT_40, a40),
+};
+const int NUM_FONT_ATLASES = sizeof(font_atlas) / sizeof(font_atlas[0]);
+
+struct FontCacheStats {
+    int loaded;     //atlases loaded so far
+    int hits;       //of those, loaded from the on-disk cache
+};
+static FontCacheStats font_stats;
+
+//On-disk layout: header, glyph tables, then w*h RGBA texels.
+struct FontCacheHeader {
+    char magic[4];
+    int version;
+    unsigned int lib;          //GGFONT_FINGERPRINT of the writer
+    int id;
+    int w, h;
+    int cstart[GGFONT_GLYPHS], clen[GGFONT_GLYPHS];
+    float tx[GGFONT_GLYPHS][2], ty[GGFONT_GLYPHS][2];
+};
+#define FONT_CACHE_VERSION 2
+
+//Path of the cache file for atlas <id>, creating the default
+//directory if needed. Returns false if there is nowhere to cache.
+static bool font_cache_path(int id, char *path, int size)
+{
+    char dir[256];
+    const char *env = getenv("GGFONT_CACHE");
+    if (env && *env) {
+	snprintf(dir, sizeof(dir), "%s", env);
+    } else {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && *xdg) {
+	    snprintf(dir, sizeof(dir), "%s", xdg);
+	} else if (home && *home) {
+	    snprintf(dir, sizeof(dir), "%s/.cache", home);
+	    mkdir(dir, 0700);
+	} else {
+	    return false;
+	}
+	strncat(dir, "/lab2", sizeof(dir) - strlen(dir) - 1);
+	mkdir(dir, 0700);
+    }
+    return snprintf(path, size, "%s/ggfont-%d.bin", dir, id) < size;
+}
+
+static bool font_cache_load(FontAtlas &a)
+{
+    char path[256];
+    if (!font_cache_path(a.id, path, sizeof(path)))
+	return false;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+	return false;
+    //Someone else's file, or one they could have written, is ignored.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    (size_t)st.st_size < sizeof(FontCacheHeader)) {
+	close(fd);
+	return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return false;
+    const FontCacheHeader *h = (const FontCacheHeader *)map;
+    bool ok = memcmp(h->magic, "GGFC", 4) == 0 &&
+	h->version == FONT_CACHE_VERSION && h->lib == GGFONT_FINGERPRINT &&
+	h->id == a.id &&
+	h->w > 0 && h->h > 0 &&
+	(size_t)st.st_size == sizeof(*h) + (size_t)h->w * h->h * 4;
+    if (ok) {
+	memcpy(a.cstart, h->cstart, sizeof(h->cstart));
+	memcpy(a.clen, h->clen, sizeof(h->clen));
+	memcpy(a.tx, h->tx, sizeof(h->tx));
+	memcpy(a.ty, h->ty, sizeof(h->ty));
+	//Same texture setup as libggfonts' build_gl_texmap().
+	glGenTextures(1, a.tex);
+	glBindTexture(GL_TEXTURE_2D, *a.tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, h->w, h->h, 0,
+		GL_RGBA, GL_UNSIGNED_BYTE, h + 1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    munmap(map, st.st_size);
+    return ok;
+}
+
+static void font_cache_save(const FontAtlas &a)
+{
+    FontCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "GGFC", 4);
+    h.version = FONT_CACHE_VERSION;
+    h.lib = GGFONT_FINGERPRINT;
+    h.id = a.id;
+    glBindTexture(GL_TEXTURE_2D, *a.tex);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &h.w);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h.h);
+    if (h.w <= 0 || h.h <= 0) {
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return;
+    }
+    size_t bytes = (size_t)h.w * h.h * 4;
+    unsigned char *texels = (unsigned char *)malloc(bytes);
+    if (texels == NULL) {
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    memcpy(h.cstart, a.cstart, sizeof(h.cstart));
+    memcpy(h.clen, a.clen, sizeof(h.clen));
+    memcpy(h.tx, a.tx, sizeof(h.tx));
+    memcpy(h.ty, a.ty, sizeof(h.ty));
+    //Write to a temp file and rename, so a reader never sees half a file.
+    //O_EXCL|O_NOFOLLOW: never write through a file or link planted there.
+    char path[256], tmp[272];
+    int fd = -1;
+    if (font_cache_path(a.id, path, sizeof(path))) {
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		0600);
+    }
+    FILE *fpo = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && fpo == NULL) {
+	close(fd);
+	unlink(tmp);
+    }
+    if (fpo) {
+	bool ok = fwrite(&h, sizeof(h), 1, fpo) == 1 &&
+	    fwrite(texels, bytes, 1, fpo) == 1;
+	ok = (fclose(fpo) == 0) && ok;
+	if (!ok || rename(tmp, path) != 0)
+	    unlink(tmp);
+    }
+    free(texels);
+}
+
+//Make sure atlas <id> is resident. Cheap after the first call.
+static void font_require(int id)
+{
+    for (int i=0; i<NUM_FONT_ATLASES; i++) {
+	FontAtlas &a = font_atlas[i];
+	if (a.id != id)
+	    continue;
+	if (a.loaded)
+	    return;
+	if (font_cache_load(a)) {
+	    ++font_stats.hits;
+	} else {
+	    load_ggfont(id);
+	    font_cache_save(a);
+	}
+	a.loaded = true;
+	++font_stats.loaded;
+	return;
+    }
+}
+
+#endif //_FONTCACHE_H_
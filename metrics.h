@@ -0,0 +1,266 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+//
+//Live metrics on a local UNIX domain socket.
+//
+//metrics_start(path) listens on <path> from a background thread. Every
+//connection gets one snapshot in Prometheus text format and is closed:
+//
+//    socat - UNIX-CONNECT:/tmp/lab2.metrics
+//
+//The main loop is the only writer. It updates plain atomics with relaxed
+//loads and stores (no locked read-modify-write), and the server thread
+//only reads them, so a scrape can never block or slow down a frame.
+//
+//Latencies are exported twice: as cumulative Prometheus histograms
+//(<name>_bucket{le=...}), for quantiles over any range on the server,
+//and as <name>_recent{quantile=...} gauges taken over the frames since
+//the previous scrape, the same window the rates use.
+//
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef std::atomic<unsigned long> MetricCounter;
+
+//Single-writer add: cheaper than fetch_add, still safe to read anywhere.
+inline void metric_add(MetricCounter &c, unsigned long v = 1)
+{
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+//Fixed-bucket latency histogram, in milliseconds.
+#define METRIC_BUCKETS 12
+static const double metric_bucket_le[METRIC_BUCKETS] = {
+    0.05, 0.1, 0.25, 0.5, 1.0, 2.0, 4.0, 8.0, 16.0, 33.0, 66.0, 1e30
+};
+
+struct MetricHistogram {
+    MetricCounter bucket[METRIC_BUCKETS];
+    std::atomic<double> sum;
+    MetricHistogram() : sum(0.0) {
+	for (int i=0; i<METRIC_BUCKETS; i++)
+	    bucket[i].store(0, std::memory_order_relaxed);
+    }
+    void observe(double ms) {
+	int i = 0;
+	while (ms > metric_bucket_le[i] && i < METRIC_BUCKETS-1)
+	    ++i;
+	metric_add(bucket[i]);
+	sum.store(sum.load(std::memory_order_relaxed) + ms,
+		std::memory_order_relaxed);
+    }
+    //Estimate a quantile by interpolating inside its bucket.
+    double quantile(double q, const unsigned long snap[METRIC_BUCKETS],
+	    unsigned long total) const {
+	if (total == 0)
+	    return 0.0;
+	double want = q * total;
+	unsigned long cum = 0;
+	for (int i=0; i<METRIC_BUCKETS; i++) {
+	    if (snap[i] && cum + snap[i] >= want) {
+		double lo = i ? metric_bucket_le[i-1] : 0.0;
+		double hi = i < METRIC_BUCKETS-1 ? metric_bucket_le[i] : lo * 2.0;
+		return lo + (hi - lo) * (want - cum) / snap[i];
+	    }
+	    cum += snap[i];
+	}
+	return metric_bucket_le[METRIC_BUCKETS-2];
+    }
+};
+
+struct Metrics {
+    std::atomic<int> particles;
+    MetricCounter spawned;
+    MetricCounter killed;
+    MetricCounter dropped;     //make_particle() at MAX_PARTICLES
+    MetricCounter frames;
+    MetricCounter arena_bytes;
+    MetricHistogram frame_ms;
+    MetricHistogram physics_ms;
+    MetricHistogram input_ms;  //input event to the frame showing its spawn
+    Metrics() : particles(0), spawned(0), killed(0), dropped(0),
+	frames(0), arena_bytes(0) { }
+};
+
+static Metrics metrics;
+
+inline long metrics_rss_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *fpi = fopen("/proc/self/statm", "r");
+    if (fpi) {
+	if (fscanf(fpi, "%ld %ld", &pages, &resident) != 2)
+	    resident = 0;
+	fclose(fpi);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+//Cumulative histogram, plus quantiles of what was observed since the
+//previous scrape. <prev> holds the bucket counts of that scrape.
+inline void metrics_histogram(std::string &out, const char *name,
+	const MetricHistogram &h, unsigned long prev[METRIC_BUCKETS])
+{
+    char line[160];
+    unsigned long snap[METRIC_BUCKETS], recent[METRIC_BUCKETS];
+    unsigned long total = 0, nrecent = 0;
+    for (int i=0; i<METRIC_BUCKETS; i++) {
+	snap[i] = h.bucket[i].load(std::memory_order_relaxed);
+	recent[i] = snap[i] - prev[i];
+	prev[i] = snap[i];
+	total += snap[i];
+	nrecent += recent[i];
+    }
+    snprintf(line, sizeof(line), "# TYPE %s histogram\n", name);
+    out += line;
+    unsigned long cum = 0;
+    for (int i=0; i<METRIC_BUCKETS; i++) {
+	cum += snap[i];
+	if (i < METRIC_BUCKETS-1) {
+	    snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %lu\n",
+		    name, metric_bucket_le[i], cum);
+	} else {
+	    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %lu\n",
+		    name, cum);
+	}
+	out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.4f\n%s_count %lu\n", name,
+	    h.sum.load(std::memory_order_relaxed), name, total);
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE %s_recent gauge\n", name);
+    out += line;
+    static const double q[] = { 0.5, 0.9, 0.99 };
+    for (int i=0; i<3; i++) {
+	snprintf(line, sizeof(line), "%s_recent{quantile=\"%g\"} %.4f\n",
+		name, q[i], h.quantile(q[i], recent, nrecent));
+	out += line;
+    }
+}
+
+//Build one scrape. Runs on the server thread.
+inline std::string metrics_text(size_t static_bytes)
+{
+    //Rates are taken over the interval since the previous scrape.
+    static double last_t = 0.0;
+    static unsigned long last_spawned = 0, last_killed = 0;
+    static unsigned long prev_frame[METRIC_BUCKETS];
+    static unsigned long prev_physics[METRIC_BUCKETS];
+    static unsigned long prev_input[METRIC_BUCKETS];
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double t = ts.tv_sec + ts.tv_nsec * 1e-9;
+    unsigned long spawned = metrics.spawned.load(std::memory_order_relaxed);
+    unsigned long killed = metrics.killed.load(std::memory_order_relaxed);
+    double dt = last_t > 0.0 ? t - last_t : 0.0;
+    double spawn_rate = dt > 0.0 ? (spawned - last_spawned) / dt : 0.0;
+    double kill_rate = dt > 0.0 ? (killed - last_killed) / dt : 0.0;
+    last_t = t;
+    last_spawned = spawned;
+    last_killed = killed;
+
+    std::string out;
+    char line[256];
+    snprintf(line, sizeof(line),
+	    "# TYPE lab2_particles gauge\nlab2_particles %d\n"
+	    "# TYPE lab2_particles_spawned_total counter\n"
+	    "lab2_particles_spawned_total %lu\n"
+	    "# TYPE lab2_particles_killed_total counter\n"
+	    "lab2_particles_killed_total %lu\n",
+	    metrics.particles.load(std::memory_order_relaxed),
+	    spawned, killed);
+    out += line;
+    snprintf(line, sizeof(line),
+	    "# TYPE lab2_particles_dropped_total counter\n"
+	    "lab2_particles_dropped_total %lu\n"
+	    "# TYPE lab2_spawn_rate gauge\nlab2_spawn_rate %.2f\n"
+	    "# TYPE lab2_kill_rate gauge\nlab2_kill_rate %.2f\n",
+	    metrics.dropped.load(std::memory_order_relaxed),
+	    spawn_rate, kill_rate);
+    out += line;
+    snprintf(line, sizeof(line),
+	    "# TYPE lab2_frames_total counter\nlab2_frames_total %lu\n"
+	    "# TYPE lab2_memory_bytes gauge\n"
+	    "lab2_memory_bytes{kind=\"rss\"} %ld\n"
+	    "lab2_memory_bytes{kind=\"particles\"} %zu\n"
+	    "lab2_memory_bytes{kind=\"frame_arena\"} %lu\n",
+	    metrics.frames.load(std::memory_order_relaxed),
+	    metrics_rss_bytes(), static_bytes,
+	    metrics.arena_bytes.load(std::memory_order_relaxed));
+    out += line;
+    metrics_histogram(out, "lab2_frame_ms", metrics.frame_ms, prev_frame);
+    metrics_histogram(out, "lab2_physics_ms", metrics.physics_ms,
+	    prev_physics);
+    metrics_histogram(out, "lab2_input_latency_ms", metrics.input_ms,
+	    prev_input);
+    return out;
+}
+
+//Start serving on a UNIX socket. Returns false if the socket
+//could not be set up; the program runs on without metrics.
+//An existing <path> is only replaced if it is a socket.
+inline bool metrics_start(const char *path, size_t static_bytes)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+	return false;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+	return false;
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+	if (!S_ISSOCK(st.st_mode)) {
+	    close(fd);
+	    return false;
+	}
+	unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, 4) != 0) {
+	close(fd);
+	return false;
+    }
+    std::thread([fd, static_bytes]() {
+	for (;;) {
+	    int c = accept(fd, NULL, NULL);
+	    if (c < 0) {
+		if (errno == EINTR || errno == ECONNABORTED)
+		    continue;
+		//Out of descriptors or memory: back off and retry.
+		if (errno == EMFILE || errno == ENFILE ||
+			errno == ENOBUFS || errno == ENOMEM) {
+		    usleep(100000);
+		    continue;
+		}
+		close(fd);
+		return;
+	    }
+	    std::string s = metrics_text(static_bytes);
+	    const char *p = s.c_str();
+	    size_t left = s.size();
+	    while (left > 0) {
+		ssize_t w = send(c, p, left, MSG_NOSIGNAL);
+		if (w <= 0)
+		    break;
+		p += w;
+		left -= w;
+	    }
+	    close(c);
+	}
+    }).detach();
+    return true;
+}
+
+#endif //_METRICS_H_
@@ -0,0 +1,134 @@
+#ifndef _MORTON_H_
+#define _MORTON_H_
+//
+//Z-order (Morton) reordering of the particle array.
+//
+//Spawn order plus the swap-removal in physics() leave neighbours in
+//space far apart in memory. tick() radix sorts the particles by the
+//Morton key of their position, either every <every> ticks or sooner
+//when the measured disorder (fraction of neighbouring array entries
+//whose keys go backwards) passes <threshold>.
+//
+//All scratch space is part of the sorter, so sorting never allocates.
+//There are no threads here; in the -p strip mode every worker process
+//sorts its own strip, which is where the parallelism comes from.
+//
+//physics() itself is a linear sweep over at most MAX_PARTICLES Boxes
+//(120 KB) with no spatial lookup, so the sort is not expected to lower
+//its miss counts; it is groundwork for grid or hash lookups. make bench
+//runs with and without -z, under -c, to show what it actually does.
+//
+#include <cstring>
+#include "perfctr.h"
+
+//Spread the low 16 bits of v to the even bit positions.
+inline unsigned int morton_spread(unsigned int v)
+{
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+inline unsigned int morton_quantize(float v, float scale)
+{
+    float q = v * scale;
+    if (q < 0.0f)
+	q = 0.0f;
+    if (q > 65535.0f)
+	q = 65535.0f;
+    return (unsigned int)q;
+}
+
+//P needs a pos[] array with x in pos[0] and y in pos[1].
+template <class P, int CAP>
+class MortonSorter {
+    private:
+	static_assert(CAP <= 65536, "indices are 16 bits");
+	unsigned int key[CAP], key2[CAP];
+	unsigned short idx[CAP], idx2[CAP];
+	P tmp[CAP];
+	unsigned long since;       //ticks since the last sort
+
+	void make_keys(const P *p, int n, float xres, float yres) {
+	    float sx = 65535.0f / xres;
+	    float sy = 65535.0f / yres;
+	    for (int i=0; i<n; i++) {
+		key[i] = morton_spread(morton_quantize(p[i].pos[0], sx)) |
+		    (morton_spread(morton_quantize(p[i].pos[1], sy)) << 1);
+	    }
+	}
+	void sort(P *p, int n) {
+	    unsigned int *k = key, *k2 = key2;
+	    unsigned short *x = idx, *x2 = idx2;
+	    for (int i=0; i<n; i++)
+		x[i] = i;
+	    for (int shift=0; shift<32; shift+=8) {
+		int count[256];
+		memset(count, 0, sizeof(count));
+		for (int i=0; i<n; i++)
+		    ++count[(k[i] >> shift) & 0xff];
+		if (count[(k[0] >> shift) & 0xff] == n)
+		    continue;
+		int sum = 0;
+		for (int d=0; d<256; d++) {
+		    int c = count[d];
+		    count[d] = sum;
+		    sum += c;
+		}
+		for (int i=0; i<n; i++) {
+		    int to = count[(k[i] >> shift) & 0xff]++;
+		    k2[to] = k[i];
+		    x2[to] = x[i];
+		}
+		unsigned int *tk = k; k = k2; k2 = tk;
+		unsigned short *tx = x; x = x2; x2 = tx;
+	    }
+	    for (int i=0; i<n; i++)
+		tmp[i] = p[x[i]];
+	    for (int i=0; i<n; i++)
+		p[i] = tmp[i];
+	}
+    public:
+	int every;                 //0 = off
+	float threshold;
+	int check_every;           //ticks between disorder checks
+	//statistics
+	unsigned long sorts;
+	float disorder;            //at the last check
+	double ms;                 //total time spent checking and sorting
+
+	MortonSorter() {
+	    since = 0;
+	    every = 0;
+	    threshold = 0.25f;
+	    check_every = 8;
+	    sorts = 0;
+	    disorder = 0.0f;
+	    ms = 0.0;
+	}
+	void tick(P *p, int n, float xres, float yres) {
+	    if (every <= 0 || n < 2)
+		return;
+	    ++since;
+	    bool due = since >= (unsigned long)every;
+	    if (!due && since % check_every != 0)
+		return;
+	    double t0 = perf_now_ms();
+	    make_keys(p, n, xres, yres);
+	    int back = 0;
+	    for (int i=1; i<n; i++)
+		back += key[i] < key[i-1];
+	    disorder = (float)back / (n - 1);
+	    if (due || disorder > threshold) {
+		sort(p, n);
+		since = 0;
+		++sorts;
+	    }
+	    ms += perf_now_ms() - t0;
+	}
+};
+
+#endif //_MORTON_H_
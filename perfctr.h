@@ -0,0 +1,210 @@
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+//
+//Hardware performance counters around named regions.
+//
+//perf.open() opens one counter group (cycles, instructions, L1D and LLC
+//misses, branch misses) for this thread with perf_event_open. Wrap a
+//region in a PerfScope and its counter deltas and wall time are added to
+//the region. If the kernel refuses (perf_event_paranoid, containers, no
+//PMU in the VM...) the regions still get wall-clock timing, and any
+//single counter the CPU lacks just reads as unavailable.
+//
+//When the PMU is shared (another perf user, the NMI watchdog) the kernel
+//may multiplex the group, so it only counts part of the time. Each
+//scope's deltas are then scaled by time enabled / time running, and
+//the region records how many calls needed it.
+//
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum {
+    PC_CYCLES = 0,
+    PC_INSTRUCTIONS,
+    PC_L1D_MISSES,
+    PC_LLC_MISSES,
+    PC_BRANCH_MISSES,
+    PC_NUM
+};
+
+static const char *perf_counter_name[PC_NUM] = {
+    "cycles", "instructions", "L1D-misses", "LLC-misses", "branch-misses"
+};
+
+struct PerfRegion {
+    const char *name;
+    unsigned long calls = 0;
+    unsigned long items = 0;        //work items, e.g. particles stepped
+    double ms = 0.0;
+    unsigned long long count[PC_NUM] = {};
+    unsigned long multiplexed = 0;  //calls whose counts had to be scaled
+    //the most recent call, for the HUD
+    double last_ms = 0.0;
+    unsigned long last_items = 0;
+    unsigned long long last[PC_NUM] = {};
+    PerfRegion(const char *n) : name(n) { }
+};
+
+class PerfCounters {
+    private:
+	int fd[PC_NUM];
+	int slot[PC_NUM];           //position of each counter in a group read
+	int nopen;
+	static int open_event(unsigned int type, unsigned long long config,
+		int group) {
+	    struct perf_event_attr pe;
+	    memset(&pe, 0, sizeof(pe));
+	    pe.size = sizeof(pe);
+	    pe.type = type;
+	    pe.config = config;
+	    pe.disabled = (group == -1);
+	    pe.exclude_kernel = 1;
+	    pe.exclude_hv = 1;
+	    pe.read_format = PERF_FORMAT_GROUP |
+		PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	    return syscall(__NR_perf_event_open, &pe, 0, -1, group, 0);
+	}
+    public:
+	bool available;
+
+	PerfCounters() {
+	    for (int i=0; i<PC_NUM; i++)
+		fd[i] = slot[i] = -1;
+	    nopen = 0;
+	    available = false;
+	}
+	~PerfCounters() {
+	    for (int i=0; i<PC_NUM; i++) {
+		if (fd[i] >= 0)
+		    close(fd[i]);
+	    }
+	}
+	bool open() {
+	    fd[PC_CYCLES] = open_event(PERF_TYPE_HARDWARE,
+		    PERF_COUNT_HW_CPU_CYCLES, -1);
+	    if (fd[PC_CYCLES] < 0)
+		return false;
+	    int lead = fd[PC_CYCLES];
+	    fd[PC_INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE,
+		    PERF_COUNT_HW_INSTRUCTIONS, lead);
+	    fd[PC_L1D_MISSES] = open_event(PERF_TYPE_HW_CACHE,
+		    PERF_COUNT_HW_CACHE_L1D |
+		    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), lead);
+	    fd[PC_LLC_MISSES] = open_event(PERF_TYPE_HARDWARE,
+		    PERF_COUNT_HW_CACHE_MISSES, lead);
+	    fd[PC_BRANCH_MISSES] = open_event(PERF_TYPE_HARDWARE,
+		    PERF_COUNT_HW_BRANCH_MISSES, lead);
+	    for (int i=0; i<PC_NUM; i++) {
+		if (fd[i] >= 0)
+		    slot[i] = nopen++;
+	    }
+	    ioctl(lead, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	    ioctl(lead, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	    available = true;
+	    return true;
+	}
+	bool has(int c) const { return slot[c] >= 0; }
+	//Read all counters in one syscall. Missing ones read as 0.
+	//*enabled and *running are the group's total times in ns.
+	void read_all(unsigned long long v[PC_NUM],
+		unsigned long long *enabled, unsigned long long *running) {
+	    memset(v, 0, sizeof(unsigned long long) * PC_NUM);
+	    *enabled = *running = 0;
+	    if (!available)
+		return;
+	    //nr, time_enabled, time_running, then the values
+	    unsigned long long buf[3 + PC_NUM];
+	    if (read(fd[PC_CYCLES], buf, sizeof(buf)) <
+		    (ssize_t)(sizeof(unsigned long long) * (3 + nopen)))
+		return;
+	    *enabled = buf[1];
+	    *running = buf[2];
+	    for (int i=0; i<PC_NUM; i++) {
+		if (slot[i] >= 0)
+		    v[i] = buf[3 + slot[i]];
+	    }
+	}
+};
+
+static PerfCounters perf;
+
+inline double perf_now_ms()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+//Adds the counter deltas and wall time of its lifetime to a region.
+class PerfScope {
+    private:
+	PerfRegion &r;
+	unsigned long items;
+	double t0;
+	unsigned long long c0[PC_NUM], en0, run0;
+    public:
+	PerfScope(PerfRegion &region, unsigned long nitems)
+	    : r(region), items(nitems) {
+	    perf.read_all(c0, &en0, &run0);
+	    t0 = perf_now_ms();
+	}
+	~PerfScope() {
+	    double t1 = perf_now_ms();
+	    unsigned long long c1[PC_NUM], en1, run1;
+	    perf.read_all(c1, &en1, &run1);
+	    r.calls++;
+	    r.items += items;
+	    r.ms += t1 - t0;
+	    r.last_ms = t1 - t0;
+	    r.last_items = items;
+	    //Extrapolate a multiplexed group to the whole scope. If it
+	    //never ran, there is nothing to scale and the call counts 0.
+	    double scale = 1.0;
+	    if (run1 - run0 < en1 - en0) {
+		scale = run1 > run0 ?
+		    (double)(en1 - en0) / (run1 - run0) : 0.0;
+		r.multiplexed++;
+	    }
+	    for (int i=0; i<PC_NUM; i++) {
+		r.last[i] = (unsigned long long)((c1[i] - c0[i]) * scale);
+		r.count[i] += r.last[i];
+	    }
+	}
+};
+
+inline double perf_ratio(double a, double b)
+{
+    return b != 0.0 ? a / b : 0.0;
+}
+
+//One line per region for the benchmark summary.
+inline void perf_report(PerfRegion *regions, int n)
+{
+    if (!perf.available)
+	printf("perf counters:   unavailable, timing only\n");
+    for (int i=0; i<n; i++) {
+	PerfRegion &r = regions[i];
+	printf("%-16s %.3f ms/call", r.name, perf_ratio(r.ms, r.calls));
+	if (perf.available) {
+	    printf("  IPC %.2f", perf_ratio(r.count[PC_INSTRUCTIONS],
+			r.count[PC_CYCLES]));
+	    for (int c=PC_L1D_MISSES; c<PC_NUM; c++) {
+		if (perf.has(c))
+		    printf("  %s/item %.3f", perf_counter_name[c],
+			    perf_ratio(r.count[c], r.items));
+	    }
+	    if (r.multiplexed)
+		printf("  (multiplexed, scaled in %lu of %lu calls)",
+			r.multiplexed, r.calls);
+	}
+	printf("\n");
+    }
+}
+
+#endif //_PERFCTR_H_
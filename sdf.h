@@ -0,0 +1,158 @@
+#ifndef _SDF_H_
+#define _SDF_H_
+//
+//Signed distance field for the static obstacles.
+//
+//bake() samples the exact signed distance to the union of all
+//obstacles on a grid with <cell> pixel spacing (negative = inside).
+//After that, sample() answers "inside, and which way is out" for any
+//point with one bilinear lookup, however many obstacles there are.
+//Bake again whenever the obstacles or the window change.
+//
+//An obstacle is the region the per-box test in physics() checks:
+//|x - cx| < w and y below the top edge. It has no bottom edge.
+//box_obstacle() and box_hit() are that mapping and that test, shared
+//by physics() and tests/sdf_test.cpp. Both look at a particle's drawn
+//position pos[0..1] only, as the SDF does.
+//
+//particle_collide() is the whole collision step of physics() for
+//either backend. A particle bounces at most once per tick, however
+//many obstacles overlap where it is. (The per-box tests used to bounce
+//once per box, so two overlapping boxes undid each other's flip.)
+//
+#include <cmath>
+#include <vector>
+
+struct SdfObstacle {
+    float cx, top, w;
+};
+
+//Box k of the scene sits at its own k-th position pair.
+template <class P>
+inline SdfObstacle box_obstacle(const P &b, int k)
+{
+    SdfObstacle o;
+    o.cx = b.pos[2*k];
+    o.top = b.pos[2*k+1] + b.h;
+    o.w = b.w;
+    return o;
+}
+
+//Per-box collision test of physics(): is particle p inside box k?
+template <class P>
+inline bool box_hit(const P &p, const P &b, int k)
+{
+    return p.pos[1] < b.pos[2*k+1] + b.h &&
+	p.pos[0] > b.pos[2*k] - b.w &&
+	p.pos[0] < b.pos[2*k] + b.w;
+}
+
+class SdfGrid {
+    private:
+	int nx, ny;                //grid nodes
+	float x0, y0;              //world position of node (0,0)
+	std::vector<float> d;
+    public:
+	//Exact signed distance from (x,y) to one obstacle.
+	static float obstacle_distance(const SdfObstacle &o, float x, float y) {
+	    float dx = fabsf(x - o.cx) - o.w;
+	    float dy = y - o.top;
+	    float ox = dx > 0.0f ? dx : 0.0f;
+	    float oy = dy > 0.0f ? dy : 0.0f;
+	    float inside = dx > dy ? dx : dy;
+	    return sqrtf(ox*ox + oy*oy) + (inside < 0.0f ? inside : 0.0f);
+	}
+	bool enabled;
+	float cell;                //grid spacing in pixels
+	float margin;              //extra border baked around the window
+	int xres, yres;            //window the grid was baked for
+	unsigned long bakes;
+
+	SdfGrid() {
+	    nx = ny = 0;
+	    x0 = y0 = 0.0f;
+	    enabled = false;
+	    cell = 4.0f;
+	    margin = 64.0f;
+	    xres = yres = 0;
+	    bakes = 0;
+	}
+	void bake(const SdfObstacle *ob, int n, int w, int h) {
+	    xres = w;
+	    yres = h;
+	    x0 = -margin;
+	    y0 = -margin;
+	    nx = (int)ceilf((w + 2.0f * margin) / cell) + 1;
+	    ny = (int)ceilf((h + 2.0f * margin) / cell) + 1;
+	    d.resize((size_t)nx * ny);
+	    for (int j=0; j<ny; j++) {
+		float y = y0 + j * cell;
+		for (int i=0; i<nx; i++) {
+		    float x = x0 + i * cell;
+		    float best = 1e30f;
+		    for (int k=0; k<n; k++) {
+			float dist = obstacle_distance(ob[k], x, y);
+			if (dist < best)
+			    best = dist;
+		    }
+		    d[(size_t)j * nx + i] = best;
+		}
+	    }
+	    ++bakes;
+	}
+	//Signed distance at (x,y), and the unit normal pointing out of
+	//the nearest obstacle in (*gx,*gy). Points off the grid are
+	//clamped to its border.
+	float sample(float x, float y, float *gx, float *gy) const {
+	    float fx = (x - x0) / cell;
+	    float fy = (y - y0) / cell;
+	    if (fx < 0.0f) fx = 0.0f;
+	    if (fy < 0.0f) fy = 0.0f;
+	    if (fx > nx - 1.001f) fx = nx - 1.001f;
+	    if (fy > ny - 1.001f) fy = ny - 1.001f;
+	    int i = (int)fx;
+	    int j = (int)fy;
+	    fx -= i;
+	    fy -= j;
+	    const float *r0 = &d[(size_t)j * nx + i];
+	    const float *r1 = r0 + nx;
+	    float d00 = r0[0], d10 = r0[1], d01 = r1[0], d11 = r1[1];
+	    float a = d00 + (d10 - d00) * fx;
+	    float b = d01 + (d11 - d01) * fx;
+	    //gradient of the bilinear patch
+	    float nxv = (d10 - d00) + ((d11 - d01) - (d10 - d00)) * fy;
+	    float nyv = b - a;
+	    float len = sqrtf(nxv*nxv + nyv*nyv);
+	    if (len > 0.0f) {
+		nxv /= len;
+		nyv /= len;
+	    } else {
+		nxv = 0.0f;
+		nyv = 1.0f;
+	    }
+	    *gx = nxv;
+	    *gy = nyv;
+	    return a + (b - a) * fy;
+	}
+};
+
+//Bounce p if it is inside an obstacle: by the SDF when given one,
+//else by the per-box tests against box[0..nbox-1].
+template <class P>
+inline void particle_collide(P &p, const P *box, int nbox, const SdfGrid *sdf)
+{
+    bool hit = false;
+    if (sdf) {
+	float nx, ny;
+	hit = sdf->sample(p.pos[0], p.pos[1], &nx, &ny) < 0.0f;
+    } else {
+	for (int k=0; k<nbox && !hit; k++)
+	    hit = box_hit(p, box[k], k);
+    }
+    if (hit) {
+	p.vel[1] = -p.vel[1] * 0.3;
+	p.vel[0] += 0.01;
+    }
+}
+
+#endif //_SDF_H_
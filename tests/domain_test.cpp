@@ -0,0 +1,150 @@
+//
+//Strip decomposition check, no X needed: make test
+//
+//Spawns particles across a 640 wide world split into 4 strip processes,
+//lets them drift across strip boundaries for a while, then checks that
+//  - every particle is in exactly one place (a snapshot or a ring)
+//  - every particle in a strip's snapshot is owned by that strip
+//  - some particles really did change strips
+//  - caught-up workers sleep instead of polling
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../domain.h"
+
+#define CAP 2000
+#define NPART 1000
+#define NSTRIPS 4
+#define XRES 640
+
+struct Part {
+    float x, vx;
+    int id;
+};
+
+typedef Domain<Part, CAP> TestDomain;
+
+//Per-process storage of a worker (each fork gets its own copy).
+static Part part[CAP];
+static int npart;
+
+static float part_x(const Part &p) { return p.x; }
+static unsigned long no_kills() { return 0; }
+static void step()
+{
+    for (int i=0; i<npart; i++) {
+	part[i].x += part[i].vx;
+	if (part[i].x < 0.0f || part[i].x > XRES)
+	    part[i].vx = -part[i].vx;
+    }
+}
+
+static int fails = 0;
+
+static void check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok)
+	++fails;
+}
+
+//Wait until every strip has stepped up to tick_target.
+static void wait_caught_up(TestDomain *d)
+{
+    unsigned int target = d->tick_target.load();
+    for (int k=0; k<d->nstrips; k++) {
+	while (d->strip[k].tick.load() != target)
+	    usleep(1000);
+    }
+}
+
+//utime + stime of a process, in clock ticks
+static long cpu_ticks(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fpi = fopen(path, "r");
+    if (fpi == NULL)
+	return -1;
+    char buf[1024];
+    long ut = -1, st = -1;
+    if (fgets(buf, sizeof(buf), fpi)) {
+	//fields after the ")" of the command name
+	char *p = strrchr(buf, ')');
+	if (p)
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld",
+		    &ut, &st);
+    }
+    fclose(fpi);
+    return ut + st;
+}
+
+int main()
+{
+    DomainWorker<Part, CAP> w;
+    w.part = part;
+    w.n = &npart;
+    w.xof = part_x;
+    w.step = step;
+    w.kills = no_kills;
+    TestDomain *d = domain_start(NSTRIPS, XRES, w);
+    if (d == NULL) {
+	printf("FAIL: cannot start strip processes\n");
+	return 1;
+    }
+    srand(1);
+    int start[NPART];
+    for (int i=0; i<NPART; i++) {
+	Part p;
+	p.x = (float)(rand() % XRES);
+	p.vx = (rand() % 2 ? 1.0f : -1.0f) * (0.5f + rand() % 40 / 10.0f);
+	p.id = i;
+	start[i] = d->owner(p.x);
+	if (!domain_inject(d, p, p.x))
+	    printf("inject ring full\n");
+    }
+    static Part view[NSTRIPS * CAP];
+    //One tick at a time, as the renderer's frames would release them.
+    for (int t=0; t<300; t++) {
+	domain_gather(d, view, NSTRIPS * CAP);
+	wait_caught_up(d);
+    }
+
+    //With the workers caught up, the snapshots and rings are stable.
+    static int seen[NPART];
+    int n = 0, misplaced = 0, moved = 0, dup = 0;
+    for (int k=0; k<d->nstrips; k++) {
+	DomainStrip<Part, CAP> &s = d->strip[k];
+	for (int i=0; i<s.n; i++) {
+	    const Part &p = s.snap[i];
+	    if (p.id < 0 || p.id >= NPART || seen[p.id]++)
+		++dup;
+	    if (d->owner(p.x) != k)
+		++misplaced;
+	    if (start[p.id] != k)
+		++moved;
+	    ++n;
+	}
+    }
+    int pending = d->pending();
+    printf("%d in snapshots, %d between strips, %d changed strips\n",
+	    n, pending, moved);
+    check(dup == 0, "no particle in two snapshots");
+    check(n + pending == NPART, "every particle accounted for");
+    check(misplaced == 0, "snapshot particles are owned by their strip");
+    check(moved > 0, "particles crossed strip boundaries");
+
+    //Idle workers must block, not poll.
+    long before[NSTRIPS];
+    for (int k=0; k<NSTRIPS; k++)
+	before[k] = cpu_ticks(d->pid[k]);
+    usleep(500000);
+    long busy = 0;
+    for (int k=0; k<NSTRIPS; k++)
+	busy += cpu_ticks(d->pid[k]) - before[k];
+    check(busy <= 1, "idle workers use no CPU");
+
+    domain_stop(d);
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+//
+//SDF vs per-box collision check, no X needed: make test
+//
+//Bakes the scene physics() uses (five default Boxes in a 640x480
+//window, box k at its k-th position pair) at several cell sizes and
+//asks both backends "is this particle inside an obstacle?" for random
+//particles. They may only disagree within one cell of an obstacle
+//edge, where the bilinear lookup blurs the boundary.
+//
+//Particles get random pos[2..9], like the 6th particle check_mouse()
+//spawns per motion event leaves stale, so a per-box test that looked
+//at anything but pos[0..1] would show up here too.
+//
+//Then it steps the same particles as physics() does under both
+//backends (particle_collide() with and without the SDF) and checks
+//that positions and velocities stay bit identical. A particle may only
+//part ways at a tick where it is within one cell of an obstacle edge;
+//after that it is not followed. At 1 px cells a particle dropped into
+//the overlap of boxes 0 and 1 at (170, 250) must match until it dies.
+//
+#include <cstdio>
+#include <cstdlib>
+#include "../sdf.h"
+
+#define XRES 640
+#define YRES 480
+#define NPOINTS 200000
+#define NPARTS 20000
+#define NTICKS 1000
+#define GRAVITY 0.05f
+
+struct Part {
+    float w, h;
+    float pos[10];
+    float vel[2];
+};
+
+//Same values as Box::Box() in xylab2.cpp.
+static void default_box(Part &b)
+{
+    b.w = 80.0f;
+    b.h = 20.0f;
+    b.pos[0] = (XRES/2)-200;
+    b.pos[1] = (YRES/2)+100;
+    b.pos[2] = (YRES/2)-25;
+    b.pos[3] = (YRES/2)+50;
+    b.pos[4] = (YRES/2)+50;
+    b.pos[5] = (YRES/2);
+    b.pos[6] = (YRES/2)+150;
+    b.pos[7] = (YRES/2)-50;
+    b.pos[8] = (YRES/2)+250;
+    b.pos[9] = (YRES/2)-100;
+}
+
+static float frand(float lo, float hi)
+{
+    return lo + (hi - lo) * ((float)rand() / (float)RAND_MAX);
+}
+
+//Distance from (x,y) to the nearest obstacle edge.
+static float edge_distance(const SdfObstacle *ob, float x, float y)
+{
+    float exact = 1e30f;
+    for (int k=0; k<5; k++) {
+	float d = fabsf(SdfGrid::obstacle_distance(ob[k], x, y));
+	if (d < exact)
+	    exact = d;
+    }
+    return exact;
+}
+
+//One tick of physics() for one particle. Returns false once it is
+//off the bottom of the window.
+static bool step(Part &p, const Part *box, const SdfGrid *sdf)
+{
+    for (int j=0; j<10; j+=2) {
+	p.pos[j] += p.vel[0];
+	p.pos[j+1] += p.vel[1];
+    }
+    p.vel[1] -= GRAVITY;
+    if (p.pos[1] < 0.0)
+	return false;
+    particle_collide(p, box, 5, sdf);
+    return true;
+}
+
+static bool same(const Part &a, const Part &b)
+{
+    return a.pos[0] == b.pos[0] && a.pos[1] == b.pos[1] &&
+	a.vel[0] == b.vel[0] && a.vel[1] == b.vel[1];
+}
+
+//Step p under both backends. Returns the tick they part ways at, or
+//-1 if they stay together until the particle dies. *edge is how far
+//from an obstacle edge that happened.
+static int trajectory(Part p, const Part *box, const SdfObstacle *ob,
+	const SdfGrid &sdf, float *edge)
+{
+    Part q = p;
+    for (int t=0; t<NTICKS; t++) {
+	bool alive = step(p, box, NULL);
+	bool alive_sdf = step(q, box, &sdf);
+	if (alive != alive_sdf || !same(p, q)) {
+	    *edge = edge_distance(ob, p.pos[0], p.pos[1]);
+	    return t;
+	}
+	if (!alive)
+	    break;
+    }
+    return -1;
+}
+
+int main()
+{
+    Part box[5];
+    SdfObstacle ob[5];
+    for (int k=0; k<5; k++) {
+	default_box(box[k]);
+	ob[k] = box_obstacle(box[k], k);
+    }
+    static const float cells[] = { 1.0f, 4.0f, 8.0f };
+    int fails = 0;
+    for (int c=0; c<3; c++) {
+	SdfGrid sdf;
+	sdf.cell = cells[c];
+	sdf.bake(ob, 5, XRES, YRES);
+	srand(1);
+	int mismatch = 0, far = 0;
+	for (int i=0; i<NPOINTS; i++) {
+	    Part p;
+	    p.w = p.h = 4.0f;
+	    p.pos[0] = frand(-20.0f, XRES + 20.0f);
+	    p.pos[1] = frand(-20.0f, YRES + 20.0f);
+	    for (int j=2; j<10; j++)
+		p.pos[j] = frand(0.0f, XRES);
+	    bool per_box = false;
+	    for (int k=0; k<5; k++)
+		per_box = per_box || box_hit(p, box[k], k);
+	    float nx, ny;
+	    bool grid = sdf.sample(p.pos[0], p.pos[1], &nx, &ny) < 0.0f;
+	    if (per_box == grid)
+		continue;
+	    ++mismatch;
+	    float exact = 1e30f;
+	    for (int k=0; k<5; k++) {
+		float d = SdfGrid::obstacle_distance(ob[k], p.pos[0], p.pos[1]);
+		if (d < exact)
+		    exact = d;
+	    }
+	    if (fabsf(exact) > cells[c]) {
+		if (far < 5)
+		    printf("  (%.2f, %.2f): per-box %d, sdf %d, %.2f px from an edge\n",
+			    p.pos[0], p.pos[1], per_box, grid, fabsf(exact));
+		++far;
+	    }
+	}
+	printf("%s: %g px cells, %d of %d disagree, %d beyond one cell\n",
+		far ? "FAIL" : "ok  ", cells[c], mismatch, NPOINTS, far);
+	if (far)
+	    ++fails;
+
+	srand(2);
+	int parted = 0;
+	far = 0;
+	for (int i=0; i<NPARTS; i++) {
+	    Part p;
+	    p.w = p.h = 4.0f;
+	    p.pos[0] = frand(0.0f, XRES);
+	    p.pos[1] = frand(0.0f, YRES);
+	    for (int j=2; j<10; j++)
+		p.pos[j] = frand(0.0f, XRES);
+	    p.vel[0] = frand(-2.0f, 2.0f);
+	    p.vel[1] = frand(-2.0f, 2.0f);
+	    float edge;
+	    int t = trajectory(p, box, ob, sdf, &edge);
+	    if (t < 0)
+		continue;
+	    ++parted;
+	    if (edge > cells[c]) {
+		if (far < 5)
+		    printf("  from (%.2f, %.2f): parted at tick %d, %.2f px from an edge\n",
+			    p.pos[0], p.pos[1], t, edge);
+		++far;
+	    }
+	}
+	printf("%s: %g px cells, %d of %d trajectories part, %d away from an edge\n",
+		far ? "FAIL" : "ok  ", cells[c], parted, NPARTS, far);
+	if (far)
+	    ++fails;
+    }
+
+    //Inside boxes 0 and 1 at once: per box, this used to bounce twice a
+    //tick and drift off from the SDF's single bounce.
+    SdfGrid sdf;
+    sdf.cell = 1.0f;
+    sdf.bake(ob, 5, XRES, YRES);
+    Part p;
+    p.w = p.h = 4.0f;
+    for (int j=0; j<10; j+=2) {
+	p.pos[j] = 170.0f;
+	p.pos[j+1] = 250.0f;
+    }
+    p.vel[0] = 0.05f;
+    p.vel[1] = 0.0f;
+    float edge;
+    int t = trajectory(p, box, ob, sdf, &edge);
+    if (t >= 0)
+	printf("FAIL: particle from (170, 250) parts at tick %d\n", t);
+    else
+	printf("ok  : particle from (170, 250) matches until it dies\n");
+    if (t >= 0)
+	++fails;
+    return fails ? 1 : 0;
+}
@@ -13,12 +13,24 @@ using namespace std;
 #include <ctime>
 #include <cstring>
 #include <cmath>
+#include <atomic>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <GL/glx.h>
 #include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
 //#include "log.h"
 #include "fonts.h"
+#include "arena.h"
+#include "drawlist.h"
+#include "perfctr.h"
+#include "metrics.h"
+#include "domain.h"
+#include "morton.h"
+#include "sdf.h"
+#include "qparticle.h"
 
 //some structures
 
@@ -26,6 +38,8 @@ class Global {
     public:
 	int xres, yres;
 	int n;
+	int show_hud;
+	int state_changes;   //GL state changes in the last frame
 	Global(); 
 
 } g,gl;
@@ -92,6 +106,8 @@ class X11_wrapper {
 	void set_title();
 	bool getXPending();
 	XEvent getXNextEvent();
+	int connection();
+	void collapse_motion(XEvent *e);
 	void swapBuffers();
 	void reshape_window(int width, int height);
 	void check_resize(XEvent *e);
@@ -102,31 +118,370 @@ class X11_wrapper {
 //Function prototypes
 void init_opengl(void);
 void physics(void);
+void qphysics(void);
 void render(void);
+void make_particle(int x, int y);
+
+#ifdef LAB2_BENCH
+//Heap allocation counter, read by the benchmark to check that
+//steady-state frames stay off the heap. Per thread, so allocations of
+//the metrics server thread do not count against the main loop.
+//Only the lab2-bench build (make bench) has it.
+static thread_local unsigned long heap_allocs = 0;
+
+void *operator new(size_t size)
+{
+    ++heap_allocs;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+	throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+//Profiled regions of the main loop, see perfctr.h.
+enum { PROF_PHYSICS, PROF_RENDER, PROF_NUM };
+PerfRegion prof[PROF_NUM] = { PerfRegion("physics"), PerfRegion("render") };
+
+//Optional Z-order reordering of particle[], see morton.h.
+MortonSorter<Box, MAX_PARTICLES> zorder;
+
+//Optional signed distance field collision backend, see sdf.h.
+SdfGrid sdf;
+
+void scene_obstacles(SdfObstacle ob[5])
+{
+    for (int k=0; k<5; k++)
+	ob[k] = box_obstacle(box[k], k);
+}
+
+void sdf_bake_scene()
+{
+    SdfObstacle ob[5];
+    scene_obstacles(ob);
+    sdf.bake(ob, 5, g.xres, g.yres);
+}
+
+//Quantized storage mode: ./lab2 -q, see qparticle.h.
+//qpart holds the world; particle[] only stages spawns past qpart.n
+//until the next tick encodes them.
+QParticles<MAX_PARTICLES> qpart;
+bool qmode = false;
+
+//The simulation ticks at a fixed rate from a timerfd. The timer is
+//disarmed while nothing moves, so an idle window sleeps in poll().
+const int TICK_HZ = 60;
+
+void set_tick_timer(int tfd, bool on)
+{
+    itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+	its.it_interval.tv_nsec = 1000000000L / TICK_HZ;
+	its.it_value = its.it_interval;
+    }
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+//Domain-decomposed mode: ./lab2 -p <strips>, see domain.h.
+//The world can grow to what all strips hold together (dom_capacity).
+//particle[] only stages this frame's spawns; the renderer draws its
+//gathered view of the strips from dom_view[].
+typedef Domain<Box, MAX_PARTICLES> SimDomain;
+SimDomain *dom = NULL;
+Box *dom_view = NULL;
+int dom_view_n = 0;
+int dom_staged = 0;
+int dom_capacity = 0;
+
+static float particle_x(const Box &p) { return p.pos[0]; }
+static unsigned long particle_kills()
+{
+    return metrics.killed.load(std::memory_order_relaxed);
+}
+
+void domain_frame()
+{
+    static unsigned long killed = 0, dropped = 0;
+    dom->xres.store(g.xres, std::memory_order_relaxed);
+    for (int i=0; i<dom_staged; i++) {
+	if (!domain_inject(dom, particle[i], particle[i].pos[0]))
+	    metric_add(metrics.dropped);
+    }
+    dom_staged = 0;
+    dom_view_n = domain_gather(dom, dom_view, dom_capacity);
+    //Particles crossing between strips are in no snapshot yet.
+    g.n = dom_view_n + dom->pending();
+    unsigned long k = 0, d = 0;
+    for (int i=0; i<dom->nstrips; i++) {
+	k += dom->strip[i].killed.load(std::memory_order_relaxed);
+	d += dom->strip[i].dropped.load(std::memory_order_relaxed);
+    }
+    metric_add(metrics.killed, k - killed);
+    metric_add(metrics.dropped, d - dropped);
+    killed = k;
+    dropped = d;
+}
+
+//Index in particle[] for a new particle, or -1 at capacity.
+int spawn_slot()
+{
+    if (dom) {
+	if (dom_staged == MAX_PARTICLES || g.n >= dom_capacity)
+	    return -1;
+	++g.n;
+	return dom_staged++;
+    }
+    if (g.n == MAX_PARTICLES)
+	return -1;
+    return g.n++;
+}
+
+//Benchmark mode: ./lab2 -b <frames>
+//An emitter sweeps across the window instead of the mouse.
+const int BENCH_WARMUP = 100;
+
+void bench_spawn(int frame)
+{
+    int x = g.xres/2 + (int)(200.0 * sin(frame * 0.02));
+    for (int i=0; i < 6; i++)
+	make_particle(x, g.yres - 20);
+}
+
+unsigned long bench_heap_count()
+{
+#ifdef LAB2_BENCH
+    return heap_allocs + frame_arena().blocks;
+#else
+    return frame_arena().blocks;
+#endif
+}
 
 
 
 //=====================================
 // MAIN FUNCTION IS HERE
 //=====================================
-int main()
+int main(int argc, char *argv[])
 {
+    //  -b <frames>  run the benchmark for that many frames and exit
+    //  -c           read hardware performance counters (perfctr.h)
+    //  -m <path>    serve live metrics on a UNIX socket (metrics.h)
+    //  -p <strips>  step the world in that many processes (domain.h)
+    //  -z <ticks>   Morton-sort particles at least every <ticks> (morton.h)
+    //  -s <cell>    collide against an SDF with <cell> px spacing (sdf.h)
+    //  -q           keep particles in 16-bit quantized storage (qparticle.h)
+    int bench = 0;
+    const char *metrics_path = NULL;
+    int strips = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:cm:p:qs:z:")) != -1) {
+	switch (opt) {
+	    case 'b':
+		bench = atoi(optarg);
+		srand(1);
+		break;
+	    case 'c':
+		if (!perf.open())
+		    printf("perf_event_open denied, timing only\n");
+		break;
+	    case 'm':
+		metrics_path = optarg;
+		if (!metrics_start(metrics_path, sizeof(particle))) {
+		    printf("cannot serve metrics on %s\n", metrics_path);
+		    metrics_path = NULL;
+		}
+		break;
+	    case 'p':
+		strips = atoi(optarg);
+		break;
+	    case 'q':
+		qmode = true;
+		break;
+	    case 's':
+		sdf.enabled = true;
+		sdf.cell = atof(optarg);
+		if (sdf.cell < 1.0f)
+		    sdf.cell = 1.0f;
+		break;
+	    case 'z':
+		zorder.every = atoi(optarg);
+		break;
+	    default:
+		printf("usage: %s [-b frames] [-c] [-m socket] [-p strips]"
+			" [-q] [-s cell] [-z ticks]\n", argv[0]);
+		return 1;
+	}
+    }
+    if (qmode && (strips > 0 || zorder.every > 0)) {
+	printf("-q cannot be combined with -p or -z\n");
+	return 1;
+    }
     init_opengl();
+    //Without the tick timer a window with live particles would sleep
+    //in poll() forever, so do not start at all.
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+	printf("cannot create the tick timer\n");
+	return 1;
+    }
+    if (strips > 0) {
+	DomainWorker<Box, MAX_PARTICLES> w;
+	w.part = particle;
+	w.n = &g.n;
+	w.xof = particle_x;
+	w.step = physics;
+	w.kills = particle_kills;
+	dom = domain_start(strips, g.xres, w);
+	if (dom == NULL) {
+	    printf("cannot start %d strip processes\n", strips);
+	    return 1;
+	}
+	dom_capacity = dom->nstrips * MAX_PARTICLES;
+	dom_view = new Box[dom_capacity];
+    }
     //Main loop
     int done = 0;
+    int frame = 0;
+    double total_ms = 0.0;
+    unsigned long steady_allocs = 0;
+    long state_changes = 0;
+    //Time the oldest not-yet-drawn spawn was received, 0 if none.
+    double spawn_t = 0.0;
+    //Start of the previous frame's work.
+    double last_t0 = 0.0;
+    int xfd = x11.connection();
+    bool ticking = false;
     while (!done) {
+	//The benchmark runs flat out; otherwise block until there is
+	//input or a tick is due.
+	bool tick = bench > 0;
+	bool active = g.n > 0;
+	if (!bench && active != ticking) {
+	    set_tick_timer(tfd, active);
+	    ticking = active;
+	}
+	//When this wakeup's input arrived: the moment poll() saw the X
+	//connection readable. Events Xlib had already queued came in
+	//while the previous frame ran, so they date from its start.
+	double wake_t = last_t0 != 0.0 ? last_t0 : perf_now_ms();
+	//Collect a due tick every time round. Events that queued up during
+	//the last frame skip poll() below, and must not starve physics.
+	uint64_t expired;
+	if (read(tfd, &expired, sizeof(expired)) > 0)
+	    tick = true;
+	if (!bench && !tick && !x11.getXPending()) {
+	    pollfd pfd[2];
+	    pfd[0].fd = xfd;
+	    pfd[0].events = POLLIN;
+	    pfd[1].fd = tfd;
+	    pfd[1].events = POLLIN;
+	    if (poll(pfd, 2, -1) < 0)
+		continue;
+	    if (pfd[0].revents & POLLIN)
+		wake_t = perf_now_ms();
+	    if ((pfd[1].revents & POLLIN) &&
+		    read(tfd, &expired, sizeof(expired)) > 0)
+		tick = true;
+	}
 	//Process external events.
+	bool input = false;
 	while (x11.getXPending()) {
 	    XEvent e = x11.getXNextEvent();
+	    x11.collapse_motion(&e);
+	    int n0 = g.n;
 	    x11.check_resize(&e);
 	    x11.check_mouse(&e);
-	    done = x11.check_keys(&e);
+	    if (x11.check_keys(&e))
+		done = 1;
+	    if (g.n != n0 && spawn_t == 0.0)
+		spawn_t = wake_t;
+	    input = true;
+	}
+	if (!tick && !input)
+	    continue;
+	unsigned long allocs = bench_heap_count();
+	double t0 = perf_now_ms();
+	last_t0 = t0;
+	if (bench)
+	    bench_spawn(frame);
+	if (tick) {
+	    PerfScope ps(prof[PROF_PHYSICS], g.n);
+	    if (dom)
+		domain_frame();
+	    else if (qmode)
+		qphysics();
+	    else
+		physics();
+	}
+	{
+	    PerfScope ps(prof[PROF_RENDER], g.n);
+	    render();
 	}
-	physics();
-	render();
 	x11.swapBuffers();
-	usleep(200);
+	//All transient frame data dies here.
+	frame_arena().reset();
+	double t1 = perf_now_ms();
+	if (spawn_t != 0.0) {
+	    metrics.input_ms.observe(t1 - spawn_t);
+	    spawn_t = 0.0;
+	}
+	metrics.frame_ms.observe(t1 - t0);
+	if (tick)
+	    metrics.physics_ms.observe(prof[PROF_PHYSICS].last_ms);
+	metrics.particles.store(g.n, std::memory_order_relaxed);
+	metrics.arena_bytes.store(frame_arena().capacity(),
+		std::memory_order_relaxed);
+	metric_add(metrics.frames);
+	if (bench && ++frame >= bench) {
+	    done = 1;
+	}
+	if (frame > BENCH_WARMUP) {
+	    total_ms += t1 - t0;
+	    steady_allocs += bench_heap_count() - allocs;
+	    state_changes += g.state_changes;
+	}
+    }
+    close(tfd);
+    if (bench) {
+	int n = bench - BENCH_WARMUP;
+	printf("frames:          %d (+%d warmup)\n", n, BENCH_WARMUP);
+	printf("avg frame:       %.3f ms\n", n > 0 ? total_ms / n : 0.0);
+	printf("particles:       %d\n", g.n);
+	printf("state changes:   %.1f per frame\n",
+		n > 0 ? (double)state_changes / n : 0.0);
+#ifdef LAB2_BENCH
+	printf("heap allocs:     %lu in steady-state frames\n", steady_allocs);
+#else
+	printf("heap allocs:     not counted outside lab2-bench, %lu arena"
+		" overflow blocks\n", steady_allocs);
+#endif
+	printf("arena high-water %zu of %zu bytes\n",
+		frame_arena().high, frame_arena().capacity());
+	printf("font atlases:    %d of %d loaded, %d from cache\n",
+		font_stats.loaded, NUM_FONT_ATLASES, font_stats.hits);
+	if (qmode) {
+	    printf("storage:         quantized, %d bytes/particle, %s kernel\n",
+		    qpart.bytes_per_particle(), qpart.simd ? "AVX2+F16C" : "scalar");
+	} else {
+	    printf("storage:         float, %zu bytes/particle\n", sizeof(Box));
+	}
+	if (sdf.enabled) {
+	    printf("collision:       SDF, %.0f px cells, %lu bakes\n",
+		    sdf.cell, sdf.bakes);
+	}
+	if (zorder.every > 0) {
+	    printf("morton sorts:    %lu, %.3f ms total, disorder %.2f\n",
+		    zorder.sorts, zorder.ms, zorder.disorder);
+	}
+	perf_report(prof, PROF_NUM);
     }
+    if (dom)
+	domain_stop(dom);
+    if (metrics_path)
+	unlink(metrics_path);
     return 0;
 }
 
@@ -135,6 +490,8 @@ Global::Global()
     xres = 640;
     yres = 480;
     n = 0;
+    show_hud = 0;
+    state_changes = 0;
 }
 
 X11_wrapper::~X11_wrapper()
@@ -194,6 +551,22 @@ XEvent X11_wrapper::getXNextEvent()
     return e;
 }
 
+int X11_wrapper::connection()
+{
+    //File descriptor of the X connection, for poll().
+    return ConnectionNumber(dpy);
+}
+
+void X11_wrapper::collapse_motion(XEvent *e)
+{
+    //Skip ahead to the newest queued motion event;
+    //only the latest pointer position matters.
+    if (e->type != MotionNotify)
+	return;
+    while (XCheckTypedWindowEvent(dpy, win, MotionNotify, e))
+	;
+}
+
 void X11_wrapper::swapBuffers()
 {
     glXSwapBuffers(dpy, win);
@@ -229,24 +602,26 @@ void X11_wrapper::check_resize(XEvent *e)
 #define rnd() ((float)rand() / (float)RAND_MAX)
 
 void make_particle(int x, int y){
-    if (g.n < MAX_PARTICLES) {
-	particle[g.n].w = 4;
-	particle[g.n].h = 4;
-	particle[g.n].pos[0] = x;
-	particle[g.n].pos[1] = y;
-	particle[g.n].pos[2] = x;
-	particle[g.n].pos[3] = y;
-	particle[g.n].pos[4] = x;
-	particle[g.n].pos[5] = y;
-	particle[g.n].pos[6] = x;
-	particle[g.n].pos[7] = y;
-	particle[g.n].pos[8] = x;
-	particle[g.n].pos[9] = y;
-	particle[g.n].vel[1] = ((float)rand() / (float)RAND_MAX) * 0.2 - 0.1;
-	particle[g.n].vel[0] = ((float)rand() / (float)RAND_MAX) * 0.2 - 0.1;
-	++g.n;
+    int s = spawn_slot();
+    if (s >= 0) {
+	particle[s].w = 4;
+	particle[s].h = 4;
+	particle[s].pos[0] = x;
+	particle[s].pos[1] = y;
+	particle[s].pos[2] = x;
+	particle[s].pos[3] = y;
+	particle[s].pos[4] = x;
+	particle[s].pos[5] = y;
+	particle[s].pos[6] = x;
+	particle[s].pos[7] = y;
+	particle[s].pos[8] = x;
+	particle[s].pos[9] = y;
+	particle[s].vel[1] = ((float)rand() / (float)RAND_MAX) * 0.2 - 0.1;
+	particle[s].vel[0] = ((float)rand() / (float)RAND_MAX) * 0.2 - 0.1;
+	metric_add(metrics.spawned);
 	return;
     }
+    metric_add(metrics.dropped);
 }
 
 
@@ -287,13 +662,16 @@ void X11_wrapper::check_mouse(XEvent *e)
 		make_particle(e->xbutton.x, g.yres - e->xbutton.y);
 	    }
 
-	    if (g.n < MAX_PARTICLES) {
-		particle[g.n].w = 4;
-		particle[g.n].h = 4;
-		particle[g.n].pos[0] = e->xbutton.x;
-		particle[g.n].pos[1] = g.yres - e->xbutton.y;
-		particle[g.n].vel[0] = particle[g.n].vel[1] = 0.0;
-		++g.n;
+	    int s = spawn_slot();
+	    if (s >= 0) {
+		particle[s].w = 4;
+		particle[s].h = 4;
+		particle[s].pos[0] = e->xbutton.x;
+		particle[s].pos[1] = g.yres - e->xbutton.y;
+		particle[s].vel[0] = particle[s].vel[1] = 0.0;
+		metric_add(metrics.spawned);
+	    } else {
+		metric_add(metrics.dropped);
 	    }
 
 	}
@@ -310,6 +688,9 @@ int X11_wrapper::check_keys(XEvent *e)
 	    case XK_1:
 		//Key 1 was pressed
 		break;
+	    case XK_h:
+		g.show_hud = !g.show_hud;
+		break;
 	    case XK_Escape:
 		//Escape key was pressed
 		return 1;
@@ -331,7 +712,7 @@ void init_opengl(void)
     glClearColor(0.1, 0.1, 0.1, 1.0);
     // set box color
     unsigned char c[3] = {100, 200, 100};
-    for (int i = 0; i <6; i++){
+    for (int i = 0; i <5; i++){
 	    box[i].set_color(c);
     }
 }
@@ -339,6 +720,10 @@ const float GRAVITY = 0.05;
 
 void physics()
 {
+    zorder.tick(particle, g.n, g.xres, g.yres);
+    if (sdf.enabled && (sdf.xres != g.xres || sdf.yres != g.yres))
+	sdf_bake_scene();
+    int killed = 0;
     for (int i =0; i< g.n; i++) {
 	particle[i].pos[0] += particle[i].vel[0]; // + or - changes the direction
 	particle[i].pos[1] += particle[i].vel[1];
@@ -355,47 +740,34 @@ void physics()
 	// check if particle went off screen...
 	if (particle[i].pos[1] < 0.0){
 	    particle[i] = particle[--g.n];
+	    ++killed;
 	}
 
-	// check for box particle collision
-	if (particle[i].pos[1] < box[0].pos[1]+box[0].h &&
-        	particle[i].pos[0] > box[0].pos[0]-box[0].w &&
-        	particle[i].pos[0] < box[0].pos[0]+box[0].w)
-    	{
-        	particle[i].vel[1] = -particle[i].vel[1] * 0.3;
-        	particle[i].vel[0] += 0.01;
-    	}
-    	if (particle[i].pos[3] < box[1].pos[3]+box[1].h &&
-        	particle[i].pos[2] > box[1].pos[2]-box[1].w &&
-        	particle[i].pos[2] < box[1].pos[2]+box[1].w)
-    	{
-        	particle[i].vel[1] = -particle[i].vel[1] * 0.3;
-        	particle[i].vel[0] += 0.01;
-	}
-	
-    	if (particle[i].pos[5] < box[2].pos[5]+box[2].h &&
-        	particle[i].pos[4] > box[2].pos[4]-box[2].w &&
-        	particle[i].pos[4] < box[2].pos[4]+box[2].w)
-    	{
-        	particle[i].vel[1] = -particle[i].vel[1] * 0.3;
-        	particle[i].vel[0] += 0.01;
-    	}
-	
-    	if (particle[i].pos[7] < box[3].pos[7]+box[3].h &&
-        	particle[i].pos[6] > box[3].pos[6]-box[3].w &&
-        	particle[i].pos[6] < box[3].pos[6]+box[3].w)
-    	{
-        	particle[i].vel[1] = -particle[i].vel[1] * 0.3;
-        	particle[i].vel[0] += 0.01;
-    	}
-    	if (particle[i].pos[9] < box[4].pos[9]+box[4].h &&
-        	particle[i].pos[8] > box[4].pos[8]-box[4].w &&
-        	particle[i].pos[8] < box[4].pos[8]+box[4].w)
-    	{
-        	particle[i].vel[1] = -particle[i].vel[1] * 0.3;
-        	particle[i].vel[0] += 0.01;
-		}
+	// check for box particle collision, or ask the SDF
+	particle_collide(particle[i], box, 5, sdf.enabled ? &sdf : NULL);
     }
+    metric_add(metrics.killed, killed);
+}
+
+void qphysics()
+{
+    if (sdf.enabled && (sdf.xres != g.xres || sdf.yres != g.yres))
+	sdf_bake_scene();
+    qpart.resize(g.xres, g.yres);
+    for (int i=qpart.n; i<g.n; i++) {
+	qpart.add(particle[i].pos[0], particle[i].pos[1],
+		particle[i].vel[0], particle[i].vel[1]);
+    }
+    SdfObstacle ob[5];
+    scene_obstacles(ob);
+    QStepParams p;
+    p.gravity = GRAVITY;
+    p.ob = ob;
+    p.nob = 5;
+    p.sdf = sdf.enabled ? &sdf : NULL;
+    int killed = qpart.step(p);
+    g.n = qpart.n;
+    metric_add(metrics.killed, killed);
 }
 /*
 void render()
@@ -443,46 +815,69 @@ void render()
 */
 void render(void)
 {
+    static DrawList dl;
     glClear(GL_COLOR_BUFFER_BIT);
+    dl.begin(frame_arena(), 5*5 + g.n + 8);
     //Draw boxes
-    //Draw box.
-    for (int i =0; i <= 5; i++) { // i = num of boxes
-            for (int j =0; j <=9; j++){ // j = box positions
-                    glPushMatrix();
-                    glColor3ubv(box[i].color);
-                    glTranslatef(box[i].pos[j], box[i].pos[j+1], 0.0f);
-                    glBegin(GL_QUADS);
-                    glVertex2f(-box[i].w, -box[i].h);
-                    glVertex2f(-box[i].w,  box[i].h);
-                    glVertex2f( box[i].w,  box[i].h);
-                    glVertex2f( box[i].w, -box[i].h);
-                    glEnd();
-                    glPopMatrix();
-                    j++;
-    }
+    for (int i =0; i < 5; i++) { // i = num of boxes
+	int m = dl.material(box[i].color);
+	for (int j =0; j <=9; j+=2) { // j = box positions
+	    dl.quad(LAYER_BOXES, m, box[i].pos[j], box[i].pos[j+1],
+		    box[i].w, box[i].h);
+	}
     }
     //Render "Test test test"
-    Rect r;
-    r.bot = g.yres/2-20;
-    r.left = g.xres/2-40;
-    r.center = 0;
-    ggprint8b(&r, 16, 0x00ff0000, "Test test test");
-
+    dl.textf(LAYER_TEXT, FONT_8B, g.xres/2-40, g.yres/2-20, 0x00ff0000,
+	    "Test test test");
     //Draw particle.
-    for (int i =0; i< g.n; i++) {
-	glPushMatrix();
-	glColor3ub(150, 160, 220);
-	glTranslatef(particle[i].pos[0], particle[i].pos[1], 0.0f);
-	glBegin(GL_QUADS);
-	glVertex2f(- particle[i].w, -particle[i].h);
-	glVertex2f(- particle[i].w, particle[i].h);
-	glVertex2f(  particle[i].w, particle[i].h);
-	glVertex2f(  particle[i].w, -particle[i].h);
-	glEnd();
-	glPopMatrix();
-
+    static const unsigned char pcolor[3] = {150, 160, 220};
+    int pm = dl.material(pcolor);
+    int i = 0, n = g.n;
+    if (qmode) {
+	//same 4x4 size make_particle() gives every particle
+	for (; i < qpart.n; i++) {
+	    dl.quad(LAYER_PARTICLES, pm, qpart.decode_x(i), qpart.decode_y(i),
+		    4, 4);
+	}
     }
-
+    if (dom) {
+	//the gathered strips, then spawns not handed over yet
+	for (int j=0; j<dom_view_n; j++) {
+	    dl.quad(LAYER_PARTICLES, pm, dom_view[j].pos[0],
+		    dom_view[j].pos[1], dom_view[j].w, dom_view[j].h);
+	}
+	n = dom_staged;
+    }
+    for (; i< n; i++) {
+	dl.quad(LAYER_PARTICLES, pm, particle[i].pos[0], particle[i].pos[1],
+		particle[i].w, particle[i].h);
+    }
+    if (g.show_hud) {
+	int items = dl.size() + 3 + PROF_NUM; //including the HUD lines
+	int y = g.yres - 20;
+	dl.textf(LAYER_HUD, FONT_8B, 10, y, 0x00ffff00,
+		"particles: %d", g.n);
+	dl.textf(LAYER_HUD, FONT_8B, 10, y-16, 0x00ffff00,
+		"draw items: %d", items);
+	dl.textf(LAYER_HUD, FONT_8B, 10, y-32, 0x00ffff00,
+		"state changes: %d", g.state_changes);
+	for (int i=0; i<PROF_NUM; i++) {
+	    PerfRegion &pr = prof[i];
+	    y -= 16;
+	    if (perf.available) {
+		dl.textf(LAYER_HUD, FONT_8B, 10, y-32, 0x00ffff00,
+			"%s: %.3f ms  IPC %.2f  L1/p %.2f  LLC/p %.2f  br/p %.2f",
+			pr.name, pr.last_ms,
+			perf_ratio(pr.last[PC_INSTRUCTIONS], pr.last[PC_CYCLES]),
+			perf_ratio(pr.last[PC_L1D_MISSES], pr.last_items),
+			perf_ratio(pr.last[PC_LLC_MISSES], pr.last_items),
+			perf_ratio(pr.last[PC_BRANCH_MISSES], pr.last_items));
+	    } else {
+		dl.textf(LAYER_HUD, FONT_8B, 10, y-32, 0x00ffff00,
+			"%s: %.3f ms", pr.name, pr.last_ms);
+	    }
+	}
+    }
+    dl.submit();
+    g.state_changes = dl.state_changes;
 }
-
-